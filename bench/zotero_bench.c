@@ -0,0 +1,79 @@
+/*
+ * Times load_entries, the sharded loader of the plugin, on a zotero.sqlite.
+ *
+ *     zotero-bench <zotero.sqlite> <threads> [runs]
+ *
+ * The plugin source is included directly so the static loader can be called;
+ * the few rofi functions it references are provided here.
+ */
+#include "../src/zotero.c"
+
+static unsigned int bench_threads = 1;
+
+int find_arg_uint(const char *const key, unsigned int *val) {
+    if (g_strcmp0(key, "-zotero-threads") == 0) {
+        *val = bench_threads;
+        return TRUE;
+    }
+    return FALSE;
+}
+
+int find_arg_str(G_GNUC_UNUSED const char *const key, G_GNUC_UNUSED char **val) { return FALSE; }
+
+int find_arg(G_GNUC_UNUSED const char *const key) { return -1; }
+
+int helper_token_match(G_GNUC_UNUSED rofi_int_matcher *const *tokens, G_GNUC_UNUSED const char *input) {
+    return FALSE;
+}
+
+gboolean helper_execute_command(G_GNUC_UNUSED const char *wd, G_GNUC_UNUSED const char *cmd,
+                                G_GNUC_UNUSED gboolean run_in_term, G_GNUC_UNUSED RofiHelperExecuteContext *context) {
+    return FALSE;
+}
+
+void history_set(G_GNUC_UNUSED const char *filename, G_GNUC_UNUSED const char *entry) {}
+
+char **history_get_list(G_GNUC_UNUSED const char *filename, unsigned int *length) {
+    *length = 0;
+    return NULL;
+}
+
+void *mode_get_private_data(const Mode *sw) { return sw->private_data; }
+
+void mode_set_private_data(Mode *sw, void *pd) { sw->private_data = pd; }
+
+int main(int argc, char **argv) {
+    if (argc < 3) {
+        fprintf(stderr, "usage: %s <zotero.sqlite> <threads> [runs]\n", argv[0]);
+        return 1;
+    }
+    bench_threads = MAX(g_ascii_strtoull(argv[2], NULL, 10), 1);
+    unsigned int runs = argc > 3 ? MAX(g_ascii_strtoull(argv[3], NULL, 10), 1) : 1;
+    gchar *url = g_strconcat("file:", argv[1], "?mode=ro&immutable=1", NULL);
+
+    double best = G_MAXDOUBLE;
+    unsigned int entries = 0;
+    for (unsigned int run = 0; run < runs; run++) {
+        ZoteroModePrivateData *pd = g_malloc0(sizeof(*pd));
+        pd->identifiers = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+        pd->strings = g_ptr_array_new_with_free_func((GDestroyNotify)g_string_chunk_free);
+        if (sqlite3_open_v2(url, &pd->db, SQLITE_OPEN_READONLY | SQLITE_OPEN_URI, NULL) != SQLITE_OK) {
+            fprintf(stderr, "Can't open database: %s\n", sqlite3_errmsg(pd->db));
+            return 1;
+        }
+        GTimer *timer = g_timer_new();
+        load_entries(pd, url);
+        best = MIN(best, g_timer_elapsed(timer, NULL));
+        entries = pd->entries->len;
+        g_timer_destroy(timer);
+
+        g_array_free(pd->entries, TRUE);
+        g_hash_table_destroy(pd->identifiers);
+        g_ptr_array_free(pd->strings, TRUE);
+        sqlite3_close(pd->db);
+        g_free(pd);
+    }
+    printf("threads %u: %u entries in %.3fs\n", bench_threads, entries, best);
+    g_free(url);
+    return 0;
+}
@@ -0,0 +1,183 @@
+#!/usr/bin/env python3
+"""
+Benchmarks loading a synthetic Zotero library with 1 to N loader threads.
+
+Generates a zotero.sqlite with the tables STATEMENT joins, then for every
+thread count either
+  * runs zotero-bench, which times load_entries of the plugin including the
+    merge and the identifier index, the default, or
+  * runs rofi with the built plugin and reads the "Loaded ... in ...s" debug
+    line (--rofi, needs a display), or
+  * runs only the itemID-sharded STATEMENT from Python (--sql).
+
+    cmake -B build -S . -DBUILD_BENCHMARKS=ON && cmake --build build
+    ./bench/zotero_threads.py --items 500000 --threads 8
+"""
+
+import argparse
+import os
+import random
+import re
+import signal
+import sqlite3
+import subprocess
+import tempfile
+import threading
+import time
+
+SOURCE = os.path.join(os.path.dirname(__file__), "..", "src", "zotero.c")
+
+SCHEMA = """
+CREATE TABLE items(itemID INTEGER PRIMARY KEY, dateAdded TEXT, dateModified TEXT, key TEXT);
+CREATE TABLE itemAttachments(itemID INTEGER PRIMARY KEY, parentItemID INT, contentType TEXT, path TEXT);
+CREATE TABLE fields(fieldID INTEGER PRIMARY KEY, fieldName TEXT);
+CREATE TABLE itemDataValues(valueID INTEGER PRIMARY KEY, value);
+CREATE TABLE itemData(itemID INT, fieldID INT, valueID INT, PRIMARY KEY (itemID, fieldID));
+CREATE TABLE creators(creatorID INTEGER PRIMARY KEY, firstName TEXT, lastName TEXT);
+CREATE TABLE itemCreators(itemID INT, creatorID INT, orderIndex INT, PRIMARY KEY (itemID, orderIndex));
+CREATE TABLE itemNotes(itemID INTEGER PRIMARY KEY, parentItemID INT, note TEXT);
+CREATE TABLE itemAnnotations(itemID INTEGER PRIMARY KEY, parentItemID INT, text TEXT, comment TEXT);
+CREATE TABLE tags(tagID INTEGER PRIMARY KEY, name TEXT);
+CREATE TABLE itemTags(itemID INT, tagID INT);
+"""
+
+FIELDS = ["title", "date", "DOI", "extra"]
+WORDS = "attention graph neural network learning deep model sparse robust transformer".split()
+
+
+def generate(path, items):
+    db = sqlite3.connect(path)
+    db.executescript(SCHEMA)
+    db.executemany("INSERT INTO fields VALUES (?, ?)", enumerate(FIELDS, 1))
+    db.executemany(
+        "INSERT INTO creators VALUES (?, ?, ?)",
+        ((i, "First%d" % i, "Last%d" % i) for i in range(1, 5001)),
+    )
+    rng = random.Random(0)
+    value_id = 0
+
+    def rows():
+        nonlocal value_id
+        for n in range(items):
+            parent, attachment = 2 * n + 1, 2 * n + 2
+            title = " ".join(rng.choice(WORDS) for _ in range(6)) + " %d" % n
+            values = [title, "%d-01-01" % rng.randint(1950, 2024), "10.1234/%d" % n, "Citation Key: key%d" % n]
+            data = []
+            for field, value in enumerate(values, 1):
+                value_id += 1
+                data.append((value_id, value, parent, field))
+            value_id += 1
+            data.append((value_id, title, attachment, 1))
+            yield parent, attachment, data
+
+    cursor = db.cursor()
+    for parent, attachment, data in rows():
+        date = "2020-01-01 00:00:00"
+        cursor.execute("INSERT INTO items VALUES (?, ?, ?, ?)", (parent, date, date, "P%07d" % parent))
+        cursor.execute("INSERT INTO items VALUES (?, ?, ?, ?)", (attachment, date, date, "A%07d" % attachment))
+        cursor.execute(
+            "INSERT INTO itemAttachments VALUES (?, ?, 'application/pdf', ?)",
+            (attachment, parent, "storage:%d.pdf" % attachment),
+        )
+        for value_id_, value, item, field in data:
+            cursor.execute("INSERT INTO itemDataValues VALUES (?, ?)", (value_id_, value))
+            cursor.execute("INSERT INTO itemData VALUES (?, ?, ?)", (item, field, value_id_))
+        for order in range(2):
+            cursor.execute("INSERT INTO itemCreators VALUES (?, ?, ?)", (parent, rng.randint(1, 5000), order))
+    db.commit()
+    db.close()
+
+
+def statement(name):
+    with open(SOURCE) as f:
+        source = f.read()
+    match = re.search(r"static const char \*%s = QUOTE\((.*?)\n\);" % name, source, re.S)
+    return " ".join(match.group(1).split())
+
+
+def load_sql(path, threads):
+    url = "file:%s?mode=ro&immutable=1" % path
+    db = sqlite3.connect(url, uri=True)
+    first, last = db.execute(statement("ITEM_RANGE_STATEMENT")).fetchone()
+    db.close()
+    query = statement("STATEMENT")
+    step = (last - first) // threads + 1
+    counts = [0] * threads
+
+    def shard(i):
+        connection = sqlite3.connect(url, uri=True, check_same_thread=False)
+        low = first + i * step
+        counts[i] = len(connection.execute(query, (low, min(low + step - 1, last))).fetchall())
+        connection.close()
+
+    start = time.perf_counter()
+    workers = [threading.Thread(target=shard, args=(i,)) for i in range(threads)]
+    for worker in workers:
+        worker.start()
+    for worker in workers:
+        worker.join()
+    return sum(counts), time.perf_counter() - start
+
+
+def load_driver(path, threads, driver):
+    output = subprocess.run([driver, path, str(threads)], check=True, capture_output=True, text=True).stdout
+    match = re.search(r"threads \d+: (\d+) entries in ([\d.]+)s", output)
+    return int(match.group(1)), float(match.group(2))
+
+
+def load_rofi(path, threads, plugin_path):
+    home = os.path.dirname(os.path.dirname(path))
+    env = dict(os.environ, HOME=home, G_MESSAGES_DEBUG="Plugin_Zotero")
+    process = subprocess.Popen(
+        ["rofi", "-show", "zotero", "-plugin-path", plugin_path, "-zotero-threads", str(threads)],
+        env=env,
+        stderr=subprocess.PIPE,
+        text=True,
+    )
+    try:
+        for line in process.stderr:
+            match = re.search(r"Loaded (\d+) entries on \d+ threads in ([\d.]+)s", line)
+            if match:
+                return int(match.group(1)), float(match.group(2))
+    finally:
+        process.send_signal(signal.SIGTERM)
+        process.wait()
+    raise RuntimeError("rofi exited without reporting the load time")
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("--items", type=int, default=500000)
+    parser.add_argument("--threads", type=int, default=os.cpu_count())
+    parser.add_argument("--runs", type=int, default=3)
+    parser.add_argument("--driver", default="build/zotero-bench", help="path of the zotero-bench binary")
+    parser.add_argument("--rofi", action="store_true", help="time the plugin through rofi")
+    parser.add_argument("--plugin-path", default="build/lib")
+    parser.add_argument("--sql", action="store_true", help="time only the sharded SQL from Python")
+    args = parser.parse_args()
+
+    with tempfile.TemporaryDirectory() as home:
+        os.mkdir(os.path.join(home, "Zotero"))
+        path = os.path.join(home, "Zotero", "zotero.sqlite")
+        start = time.perf_counter()
+        generate(path, args.items)
+        print("Generated %d items in %.1fs." % (args.items, time.perf_counter() - start))
+
+        baseline = None
+        for threads in range(1, args.threads + 1):
+            times = []
+            for _ in range(args.runs):
+                if args.rofi:
+                    entries, elapsed = load_rofi(path, threads, os.path.abspath(args.plugin_path))
+                elif args.sql:
+                    entries, elapsed = load_sql(path, threads)
+                else:
+                    entries, elapsed = load_driver(path, threads, args.driver)
+                times.append(elapsed)
+            best = min(times)
+            baseline = baseline or best
+            print("threads %2d: %d entries in %.3fs (x%.2f)" % (threads, entries, best, baseline / best))
+
+
+if __name__ == "__main__":
+    main()
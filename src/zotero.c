@@ -10,6 +10,14 @@
 
 G_MODULE_EXPORT Mode mode;
 #define DRUN_CACHE_FILE "rofi3.zoterocache"
+#define QUERY_CACHE_FILE "rofi3.zoteroqueries"
+#define NOTES_CACHE_FILE "rofi3.zoteronotes.sqlite"
+/** Input starting with this searches notes and annotations instead. */
+#define NOTES_SEARCH_PREFIX '@'
+/** Row state flag telling rofi the display value is Pango markup. */
+#define STATE_MARKUP 8
+#define DEFAULT_DISPLAY_FORMAT "[{year}] {title} - {authors}"
+#define DEFAULT_MATCH_FORMAT "[{year}] {title} - {authors}"
 
 // clang-format off
 static const char *STATEMENT = QUOTE(
@@ -17,7 +25,16 @@ static const char *STATEMENT = QUOTE(
       name,
       path,
       group_concat(author, '; ') as authors,
-      SUBSTR(year, 1, INSTR(year || '-', '-') - 1) as year
+      SUBSTR(year, 1, INSTR(year || '-', '-') - 1) as year,
+      group_concat(doi, char(10)) as doi,
+      group_concat(isbn, char(10)) as isbn,
+      group_concat(archive_id, char(10)) as archive_id,
+      group_concat(url, char(10)) as url,
+      group_concat(citation_key, char(10)) as citation_key,
+      group_concat(extra, char(10)) as extra,
+      MIN(parent_id) as parent_id,
+      date_added,
+      date_modified
     FROM
       (
         SELECT
@@ -34,7 +51,40 @@ static const char *STATEMENT = QUOTE(
             CASE
               WHEN fieldName = 'date' THEN parentItemDataValues.value
             END
-          ) as year
+          ) as year,
+          MAX(
+            CASE
+              WHEN fieldName = 'DOI' THEN parentItemDataValues.value
+            END
+          ) as doi,
+          MAX(
+            CASE
+              WHEN fieldName = 'ISBN' THEN parentItemDataValues.value
+            END
+          ) as isbn,
+          MAX(
+            CASE
+              WHEN fieldName = 'archiveID' THEN parentItemDataValues.value
+            END
+          ) as archive_id,
+          MAX(
+            CASE
+              WHEN fieldName = 'url' THEN parentItemDataValues.value
+            END
+          ) as url,
+          MAX(
+            CASE
+              WHEN fieldName = 'citationKey' THEN parentItemDataValues.value
+            END
+          ) as citation_key,
+          MAX(
+            CASE
+              WHEN fieldName = 'extra' THEN parentItemDataValues.value
+            END
+          ) as extra,
+          parentInfo.itemID as parent_id,
+          CAST(strftime('%s', parentInfo.dateAdded) AS INTEGER) as date_added,
+          CAST(strftime('%s', parentInfo.dateModified) AS INTEGER) as date_modified
         FROM
           itemAttachments
           INNER JOIN items ON items.itemID = itemAttachments.itemID
@@ -51,51 +101,1417 @@ static const char *STATEMENT = QUOTE(
             itemAttachments.contentType LIKE '%pdf'
             OR itemAttachments.contentType LIKE '%djvu'
           )
+          AND itemAttachments.itemID BETWEEN ?1 AND ?2
         GROUP BY
           items.itemID,
           author
         ORDER BY
+          items.itemID,
           itemCreators.orderIndex
       )
     GROUP BY
       name
+    ORDER BY
+      name
+);
+
+static const char *ITEM_RANGE_STATEMENT = QUOTE(
+    SELECT MIN(itemID), MAX(itemID) FROM itemAttachments
+);
+
+static const char *PREVIEW_FIELDS_STATEMENT = QUOTE(
+    SELECT
+      fieldName,
+      itemDataValues.value
+    FROM
+      itemData
+      INNER JOIN itemDataValues ON itemData.valueID = itemDataValues.valueID
+      INNER JOIN fields ON fields.fieldID = itemData.fieldID
+    WHERE
+      itemData.itemID = ?1
+      AND fieldName IN (
+        'abstractNote', 'publicationTitle', 'proceedingsTitle', 'conferenceName',
+        'bookTitle', 'university', 'publisher'
+      )
+);
+
+static const char *PREVIEW_TAGS_STATEMENT = QUOTE(
+    SELECT
+      group_concat(tags.name, ', ')
+    FROM
+      itemTags
+      INNER JOIN tags ON tags.tagID = itemTags.tagID
+    WHERE
+      itemTags.itemID = ?1
+);
+
+static const char *PREVIEW_NOTE_STATEMENT = QUOTE(
+    SELECT
+      itemNotes.note
+    FROM
+      itemNotes
+      INNER JOIN items ON items.itemID = itemNotes.itemID
+    WHERE
+      itemNotes.parentItemID = ?1
+    ORDER BY
+      items.dateAdded
+    LIMIT 1
+);
+
+static const char *NOTES_SCHEMA = QUOTE(
+    CREATE VIRTUAL TABLE IF NOT EXISTS notes USING fts5(
+      text,
+      parent UNINDEXED,
+      attachment UNINDEXED,
+      prefix = '2 3'
+    );
+    CREATE TABLE IF NOT EXISTS state(
+      key TEXT PRIMARY KEY,
+      value TEXT
+    );
+    CREATE TABLE IF NOT EXISTS keys(
+      key TEXT PRIMARY KEY,
+      item INTEGER,
+      attachment TEXT
+    );
+    CREATE INDEX IF NOT EXISTS keys_attachment ON keys(attachment);
+);
+
+static const char *NOTES_CHANGED_STATEMENT = QUOTE(
+    SELECT
+      items.itemID,
+      items.key,
+      itemNotes.parentItemID,
+      NULL,
+      NULL,
+      itemNotes.note,
+      items.dateModified,
+      1
+    FROM
+      zotero.itemNotes
+      INNER JOIN zotero.items ON items.itemID = itemNotes.itemID
+    WHERE
+      items.dateModified >= ?1
+    UNION ALL
+    SELECT
+      items.itemID,
+      items.key,
+      itemAttachments.parentItemID,
+      itemAnnotations.parentItemID,
+      attachments.key,
+      COALESCE(itemAnnotations.text, '') || ' ' || COALESCE(itemAnnotations.comment, ''),
+      MAX(items.dateModified, attachments.dateModified),
+      0
+    FROM
+      zotero.itemAnnotations
+      INNER JOIN zotero.items ON items.itemID = itemAnnotations.itemID
+      INNER JOIN zotero.itemAttachments ON itemAttachments.itemID = itemAnnotations.parentItemID
+      INNER JOIN zotero.items AS attachments ON attachments.itemID = itemAttachments.itemID
+    WHERE
+      items.dateModified >= ?1
+      OR attachments.dateModified >= ?1
+    ORDER BY
+      7
+);
+
+static const char *NOTES_DELETED_STATEMENT = QUOTE(
+    SELECT
+      keys.key,
+      keys.item,
+      deleteLog.dateDeleted
+    FROM
+      zotero.deleteLog
+      INNER JOIN keys ON keys.key = deleteLog.key
+    WHERE
+      deleteLog.dateDeleted >= ?1
+    UNION ALL
+    SELECT
+      keys.key,
+      keys.item,
+      deleteLog.dateDeleted
+    FROM
+      zotero.deleteLog
+      INNER JOIN keys ON keys.attachment = deleteLog.key
+    WHERE
+      deleteLog.dateDeleted >= ?1
+);
+
+static const char *NOTES_SEARCH_STATEMENT = QUOTE(
+    SELECT DISTINCT parent FROM notes WHERE notes MATCH ?1
 );
 // clang-format on
 
+/**
+ * Entries are stored by value in one array, their strings live in the string
+ * chunk of the shard that loaded them.
+ */
 typedef struct {
     gchar *name;
     gchar *path;
     gchar *author;
     gchar *year;
+    sqlite3_int64 item_id;
+    sqlite3_int64 date_added;
+    sqlite3_int64 date_modified;
     int sort_index;
 } Entry;
 
+typedef enum {
+    ORDER_FRECENCY,
+    ORDER_DATE_ADDED,
+    ORDER_DATE_MODIFIED,
+    ORDER_YEAR,
+    ORDER_TITLE,
+    ORDER_AUTHOR,
+    ORDER_NUM
+} SortOrder;
+
+static const char *const ORDER_NAMES[ORDER_NUM] = {
+    [ORDER_FRECENCY] = "frecency", [ORDER_DATE_ADDED] = "added", [ORDER_DATE_MODIFIED] = "modified",
+    [ORDER_YEAR] = "year",         [ORDER_TITLE] = "title",      [ORDER_AUTHOR] = "author",
+};
+
+/** Number of rendered previews kept around. */
+#define PREVIEW_CACHE_SIZE 32
+#define PREVIEW_ABSTRACT_LENGTH 600
+#define PREVIEW_NOTE_LENGTH 300
+
+typedef enum { PREVIEW_FIELDS, PREVIEW_TAGS, PREVIEW_NOTE, PREVIEW_NUM_STATEMENTS } PreviewStatement;
+
+typedef struct {
+    Entry *entry;
+    gchar *markup;
+} Preview;
+
+typedef enum { FIELD_NONE, FIELD_TITLE, FIELD_YEAR, FIELD_AUTHORS, FIELD_PATH } FormatField;
+
+static const char *const FIELD_NAMES[] = {
+    [FIELD_TITLE] = "title", [FIELD_YEAR] = "year", [FIELD_AUTHORS] = "authors", [FIELD_PATH] = "path"};
+
+/**
+ * One step of a compiled format: either a literal or a field with its filters.
+ */
+typedef struct {
+    FormatField field;
+    const gchar *literal;
+    gsize length;
+    /** Maximum number of characters of the field, 0 for all. */
+    glong max_chars;
+    /** Only the first of the authors. */
+    gboolean first;
+    /** Append " et al." when there is more than one author. */
+    gboolean etal;
+} FormatOp;
+
+typedef struct {
+    gchar *source;
+    GArray *ops;
+    /** Whether the format is Pango markup, field values are escaped then. */
+    gboolean markup;
+} Format;
+
+/** Maximum number of query prefixes remembered on disk. */
+#define QUERY_CACHE_SIZE 4096
+/** Query prefixes are recorded from this many characters on... */
+#define QUERY_MIN_PREFIX 2
+/** ...up to this many. Longer queries are looked up by their prefix. */
+#define QUERY_MAX_PREFIX 24
+
+/**
+ * The item most often opened from a query prefix. A prefix only remembers a
+ * single item, a competing choice first wears down its count. used is the
+ * sequence number of the last time the prefix was recorded.
+ */
+typedef struct {
+    gchar *path;
+    unsigned int count;
+    guint64 used;
+    Entry *entry;
+} QueryChoice;
+
 typedef struct {
     sqlite3 *db;
     gchar *zotero_path;
-    GPtrArray *entries;
+    GArray *entries;
+    GPtrArray *strings;
+    GHashTable *identifiers;
+    Entry *identifier_match;
+    /** Citation key match that does not look like a key, only previewed. */
+    Entry *key_match;
+    Entry *preview_entry;
+    sqlite3_stmt *preview_statements[PREVIEW_NUM_STATEMENTS];
+    GQueue previews;
+    GHashTable *preview_index;
+    GHashTable *paths;
+    GHashTable *queries;
+    /** Sequence number of the last recorded query. */
+    guint64 query_sequence;
+    Entry *boosted;
+    /** Per order the entry indices in that order, and the position of each entry. */
+    unsigned int *orders[ORDER_NUM];
+    unsigned int *ranks[ORDER_NUM];
+    SortOrder order;
+    GThread *notes_indexer;
+    gchar *notes_url;
+    /** Set by the indexer when it is done, read atomically. */
+    gint notes_ready;
+    /** Set on destroy to stop the indexer early. */
+    gint notes_cancel;
+    sqlite3 *notes_db;
+    sqlite3_stmt *notes_search;
+    /** itemIDs of the parents of the notes matching the current input, or NULL. */
+    GHashTable *note_matches;
+    Format *display_format;
+    Format *match_format;
 } ZoteroModePrivateData;
 
-static void destroy_element(gpointer data) {
-    if (data != NULL) {
-        Entry *entry = (Entry *)data;
-        g_free(entry->name);
-        g_free(entry->path);
-        g_free(entry->author);
-        g_free(entry->year);
-        g_free(entry);
+static gchar *chunk_insert(GStringChunk *chunk, const unsigned char *str) {
+    return str == NULL ? NULL : g_string_chunk_insert(chunk, (const gchar *)str);
+}
+
+static const char *strip_prefixes(const char *str, const char *const *prefixes) {
+    for (const char *const *prefix = prefixes; *prefix != NULL; prefix++) {
+        if (g_str_has_prefix(str, *prefix)) {
+            return str + strlen(*prefix);
+        }
+    }
+    return str;
+}
+
+static gchar *normalize_arxiv(const char *str) {
+    static const char *const prefixes[] = {"https://arxiv.org/abs/", "http://arxiv.org/abs/", "https://arxiv.org/pdf/",
+                                           "http://arxiv.org/pdf/",  "arxiv.org/abs/",        "arxiv.org/pdf/",
+                                           "10.48550/arxiv.",        "arxiv:",                NULL};
+    const char *id = strip_prefixes(str, prefixes);
+    gsize len = strlen(id);
+    if (g_str_has_suffix(id, ".pdf")) {
+        len -= 4;
+    }
+    // Drop the version suffix, e.g. 1706.03762v5.
+    gsize end = len;
+    while (end > 0 && g_ascii_isdigit(id[end - 1])) {
+        end--;
+    }
+    if (end > 0 && end < len && id[end - 1] == 'v') {
+        len = end - 1;
+    }
+    // New style: YYMM.NNNNN
+    gsize i = 0;
+    while (i < len && g_ascii_isdigit(id[i])) {
+        i++;
+    }
+    if (i == 4 && i < len && id[i] == '.') {
+        gsize digits = len - i - 1;
+        for (i = i + 1; i < len && g_ascii_isdigit(id[i]); i++)
+            ;
+        return (i == len && (digits == 4 || digits == 5)) ? g_strndup(id, len) : NULL;
+    }
+    // Old style: archive/YYMMNNN, e.g. hep-th/9901001.
+    const char *slash = memchr(id, '/', len);
+    if (slash == NULL || slash == id || len - (slash - id) - 1 != 7) {
+        return NULL;
+    }
+    for (const char *c = id; c < slash; c++) {
+        if (!g_ascii_isalpha(*c) && *c != '-' && *c != '.') {
+            return NULL;
+        }
+    }
+    for (const char *c = slash + 1; c < id + len; c++) {
+        if (!g_ascii_isdigit(*c)) {
+            return NULL;
+        }
+    }
+    return g_strndup(id, len);
+}
+
+static gchar *normalize_doi(const char *str) {
+    static const char *const prefixes[] = {"https://doi.org/", "http://doi.org/", "https://dx.doi.org/",
+                                           "http://dx.doi.org/", "doi.org/", "doi:", NULL};
+    const char *doi = strip_prefixes(str, prefixes);
+    if (!g_str_has_prefix(doi, "10.") || strchr(doi, '/') == NULL) {
+        return NULL;
+    }
+    return g_strdup(doi);
+}
+
+static gchar *normalize_isbn(const char *str) {
+    GString *isbn = g_string_sized_new(13);
+    for (const char *c = str; *c != '\0'; c++) {
+        if (g_ascii_isdigit(*c) || *c == 'x') {
+            g_string_append_c(isbn, *c);
+        } else if (*c != '-' && *c != ' ') {
+            g_string_free(isbn, TRUE);
+            return NULL;
+        }
+    }
+    if (isbn->len != 10 && isbn->len != 13) {
+        g_string_free(isbn, TRUE);
+        return NULL;
+    }
+    // Index ISBN-10s in their ISBN-13 form so that either form finds the item.
+    if (isbn->len == 10) {
+        g_string_truncate(isbn, 9);
+        g_string_prepend(isbn, "978");
+        int sum = 0;
+        for (gsize i = 0; i < 12; i++) {
+            if (!g_ascii_isdigit(isbn->str[i])) {
+                g_string_free(isbn, TRUE);
+                return NULL;
+            }
+            sum += (isbn->str[i] - '0') * (i % 2 == 0 ? 1 : 3);
+        }
+        g_string_append_c(isbn, '0' + (10 - sum % 10) % 10);
+    }
+    return g_string_free(isbn, FALSE);
+}
+
+/**
+ * Maps a DOI, arXiv ID or ISBN to the key used in the identifier index, or NULL
+ * if the string is none of them. Expects a lowercased, stripped string.
+ */
+static gchar *normalize_identifier(const char *str) {
+    gchar *key = normalize_arxiv(str);
+    if (key == NULL) {
+        key = normalize_doi(str);
+    }
+    if (key == NULL) {
+        key = normalize_isbn(str);
     }
+    return key;
 }
 
-static int sort_entries(gconstpointer a, gconstpointer b) {
-    Entry *e1 = *((Entry **)a);
-    Entry *e2 = *((Entry **)b);
-    return e1->sort_index - e2->sort_index;
+static void index_key(GPtrArray *keys, gchar *key) {
+    if (key == NULL || *key == '\0') {
+        g_free(key);
+        return;
+    }
+    g_ptr_array_add(keys, key);
+}
+
+static void index_identifier(GPtrArray *keys, const char *value) {
+    if (value == NULL) {
+        return;
+    }
+    gchar *str = g_strstrip(g_ascii_strdown(value, -1));
+    index_key(keys, normalize_identifier(str));
+    g_free(str);
+}
+
+/**
+ * Collects the normalized identifiers of the current row as a NULL terminated
+ * list, to be added to the identifier index once the entry is merged.
+ */
+static gchar **index_entry(sqlite3_stmt *statement) {
+    GPtrArray *keys = g_ptr_array_new();
+    // Items sharing a title are grouped into one row, their identifiers are
+    // joined by newlines.
+    const int columns[] = {4, 6, 7, 8};
+    for (gsize i = 0; i < G_N_ELEMENTS(columns); i++) {
+        const char *values = (const char *)sqlite3_column_text(statement, columns[i]);
+        if (values == NULL) {
+            continue;
+        }
+        gchar **lines = g_strsplit(values, "\n", -1);
+        for (gchar **iter = lines; *iter != NULL; iter++) {
+            if (columns[i] == 8) {
+                index_key(keys, g_strstrip(g_ascii_strdown(*iter, -1)));
+            } else {
+                index_identifier(keys, *iter);
+            }
+        }
+        g_strfreev(lines);
+    }
+
+    // The ISBN field may hold several space separated ISBNs.
+    const char *isbn = (const char *)sqlite3_column_text(statement, 5);
+    if (isbn != NULL) {
+        gchar **isbns = g_strsplit_set(isbn, " ,;\n", -1);
+        for (gchar **iter = isbns; *iter != NULL; iter++) {
+            gchar *str = g_ascii_strdown(*iter, -1);
+            index_key(keys, normalize_isbn(str));
+            g_free(str);
+        }
+        g_strfreev(isbns);
+    }
+
+    // Better BibTeX and items without a dedicated field keep identifiers as
+    // "Key: value" lines in extra.
+    const char *extra = (const char *)sqlite3_column_text(statement, 9);
+    if (extra != NULL) {
+        gchar **lines = g_strsplit(extra, "\n", -1);
+        for (gchar **iter = lines; *iter != NULL; iter++) {
+            gchar *line = g_ascii_strdown(*iter, -1);
+            gchar *value = strchr(line, ':');
+            if (value != NULL) {
+                *value++ = '\0';
+                g_strstrip(line);
+                g_strstrip(value);
+                if (g_strcmp0(line, "citation key") == 0) {
+                    index_key(keys, g_strdup(value));
+                } else if (g_strcmp0(line, "doi") == 0 || g_strcmp0(line, "arxiv") == 0 ||
+                           g_strcmp0(line, "isbn") == 0) {
+                    index_key(keys, normalize_identifier(value));
+                }
+            }
+            g_free(line);
+        }
+        g_strfreev(lines);
+    }
+    g_ptr_array_add(keys, NULL);
+    return (gchar **)g_ptr_array_free(keys, FALSE);
+}
+
+/**
+ * Resolves a pasted DOI, arXiv ID, ISBN or citation key with a single probe of
+ * the identifier index. Other input without whitespace is probed as a citation
+ * key as well; exact is only set when it looks like one, i.e. has a digit, so
+ * that a key like "smith" does not hide the other matches for that word.
+ */
+static Entry *lookup_identifier(ZoteroModePrivateData *pd, const char *input, gboolean *exact) {
+    *exact = FALSE;
+    if (pd->identifiers == NULL || input == NULL) {
+        return NULL;
+    }
+    gchar *str = g_strstrip(g_ascii_strdown(input, -1));
+    gchar *key = normalize_identifier(str);
+    if (key != NULL) {
+        *exact = TRUE;
+    } else if (*str != '\0' && strpbrk(str, " \t") == NULL) {
+        key = g_strdup(str);
+        *exact = strpbrk(str, "0123456789") != NULL;
+    }
+    Entry *e = key == NULL ? NULL : g_hash_table_lookup(pd->identifiers, key);
+    g_free(key);
+    g_free(str);
+    return e;
+}
+
+typedef struct {
+    const gchar *url;
+    sqlite3_int64 first;
+    sqlite3_int64 last;
+    GArray *entries;
+    GPtrArray *identifiers;
+    GStringChunk *strings;
+    unsigned int position;
+} Shard;
+
+static gpointer load_shard(gpointer data) {
+    Shard *shard = (Shard *)data;
+    shard->entries = g_array_new(FALSE, FALSE, sizeof(Entry));
+    shard->identifiers = g_ptr_array_new_with_free_func((GDestroyNotify)g_strfreev);
+    shard->strings = g_string_chunk_new(64 * 1024);
+
+    sqlite3 *db = NULL;
+    int rc = sqlite3_open_v2(shard->url, &db, SQLITE_OPEN_READONLY | SQLITE_OPEN_URI | SQLITE_OPEN_NOMUTEX, NULL);
+    if (rc) {
+        g_debug("Can't open database: %s\n", sqlite3_errmsg(db));
+        sqlite3_close(db);
+        return NULL;
+    }
+    sqlite3_stmt *statement = 0;
+    sqlite3_prepare_v2(db, STATEMENT, -1, &statement, 0);
+    sqlite3_bind_int64(statement, 1, shard->first);
+    sqlite3_bind_int64(statement, 2, shard->last);
+    while (sqlite3_step(statement) == SQLITE_ROW) {
+        Entry e;
+        char *year = (char *)sqlite3_column_text(statement, 3);
+        e.name = chunk_insert(shard->strings, sqlite3_column_text(statement, 0));
+        e.path = chunk_insert(shard->strings, sqlite3_column_text(statement, 1));
+        e.author = chunk_insert(shard->strings, sqlite3_column_text(statement, 2));
+        e.year = g_string_chunk_insert_const(shard->strings, year == NULL ? "" : year);
+        e.item_id = sqlite3_column_int64(statement, 10);
+        e.date_added = sqlite3_column_int64(statement, 11);
+        e.date_modified = sqlite3_column_int64(statement, 12);
+        e.sort_index = 0;
+        g_array_append_val(shard->entries, e);
+        g_ptr_array_add(shard->identifiers, index_entry(statement));
+    }
+    sqlite3_finalize(statement);
+    sqlite3_close(db);
+    return NULL;
+}
+
+/**
+ * Splits the attachment itemID space into one range per thread and loads the
+ * ranges in parallel, each on its own read-only connection. Every shard comes
+ * back ordered by name, so a k-way merge restores the order of a single query.
+ */
+static void load_entries(ZoteroModePrivateData *pd, const gchar *url) {
+    unsigned int threads = g_get_num_processors();
+    find_arg_uint("-zotero-threads", &threads);
+    threads = MAX(threads, 1);
+
+    sqlite3_int64 first = 0, last = -1;
+    sqlite3_stmt *statement = 0;
+    sqlite3_prepare_v2(pd->db, ITEM_RANGE_STATEMENT, -1, &statement, 0);
+    if (sqlite3_step(statement) == SQLITE_ROW && sqlite3_column_type(statement, 0) != SQLITE_NULL) {
+        first = sqlite3_column_int64(statement, 0);
+        last = sqlite3_column_int64(statement, 1);
+    }
+    sqlite3_finalize(statement);
+    if (last < first) {
+        pd->entries = g_array_new(FALSE, FALSE, sizeof(Entry));
+        return;
+    }
+    threads = MIN(threads, (unsigned int)MIN(last - first + 1, G_MAXUINT));
+
+    GTimer *timer = g_timer_new();
+    Shard *shards = g_new0(Shard, threads);
+    GThread **workers = g_new0(GThread *, threads);
+    sqlite3_int64 step = (last - first) / threads + 1;
+    for (unsigned int i = 0; i < threads; i++) {
+        shards[i].url = url;
+        shards[i].first = first + i * step;
+        shards[i].last = MIN(shards[i].first + step - 1, last);
+        if (i + 1 < threads) {
+            workers[i] = g_thread_new("zotero-loader", load_shard, &shards[i]);
+        }
+    }
+    load_shard(&shards[threads - 1]);
+    for (unsigned int i = 0; i + 1 < threads; i++) {
+        g_thread_join(workers[i]);
+    }
+
+    // Reserve room for every row up front: the array never reallocates, so
+    // pointers to entries stay valid.
+    guint rows = 0;
+    for (unsigned int i = 0; i < threads; i++) {
+        rows += shards[i].entries->len;
+    }
+    pd->entries = g_array_sized_new(FALSE, FALSE, sizeof(Entry), rows);
+    int n = 0;
+    Entry *kept = NULL;
+    for (;;) {
+        Shard *next = NULL;
+        for (unsigned int i = 0; i < threads; i++) {
+            Shard *shard = &shards[i];
+            if (shard->entries == NULL || shard->position >= shard->entries->len) {
+                continue;
+            }
+            Entry *e = &g_array_index(shard->entries, Entry, shard->position);
+            if (next == NULL || g_strcmp0(e->name, g_array_index(next->entries, Entry, next->position).name) < 0) {
+                next = shard;
+            }
+        }
+        if (next == NULL) {
+            break;
+        }
+        Entry *e = &g_array_index(next->entries, Entry, next->position);
+        gchar **keys = g_ptr_array_index(next->identifiers, next->position);
+        next->position++;
+        // Items are grouped by name, also across shards: combine the groups the
+        // way a single query does. Authors are concatenated, and the item with
+        // the lowest itemID represents the group, as MIN(parent_id) picks the
+        // bare columns. The identifiers of both resolve to the combined entry.
+        if (kept == NULL || g_strcmp0(kept->name, e->name) != 0) {
+            e->sort_index = n++;
+            g_array_append_val(pd->entries, *e);
+            kept = &g_array_index(pd->entries, Entry, pd->entries->len - 1);
+        } else {
+            gchar *author = g_strjoin("; ", kept->author != NULL ? kept->author : "",
+                                      e->author != NULL ? e->author : "", NULL);
+            kept->author = g_string_chunk_insert(next->strings, author);
+            g_free(author);
+            if (e->item_id < kept->item_id) {
+                kept->path = e->path;
+                kept->year = e->year;
+                kept->item_id = e->item_id;
+                kept->date_added = e->date_added;
+                kept->date_modified = e->date_modified;
+            }
+        }
+        for (gchar **key = keys; *key != NULL; key++) {
+            if (!g_hash_table_contains(pd->identifiers, *key)) {
+                g_hash_table_insert(pd->identifiers, g_strdup(*key), kept);
+            }
+        }
+    }
+    for (unsigned int i = 0; i < threads; i++) {
+        if (shards[i].entries != NULL) {
+            g_array_free(shards[i].entries, TRUE);
+            g_ptr_array_free(shards[i].identifiers, TRUE);
+            g_ptr_array_add(pd->strings, shards[i].strings);
+        }
+    }
+    g_debug("Loaded %u entries on %u threads in %.3fs.", pd->entries->len, threads, g_timer_elapsed(timer, NULL));
+    g_timer_destroy(timer);
+    g_free(workers);
+    g_free(shards);
+}
+
+static void destroy_preview(gpointer data) {
+    Preview *preview = (Preview *)data;
+    g_free(preview->markup);
+    g_free(preview);
+}
+
+static gchar *truncate_text(const gchar *text, glong length) {
+    if (g_utf8_strlen(text, -1) <= length) {
+        return g_strdup(text);
+    }
+    gchar *head = g_utf8_substring(text, 0, length);
+    gchar *retv = g_strconcat(g_strchomp(head), "…", NULL);
+    g_free(head);
+    return retv;
+}
+
+/**
+ * Notes are stored as HTML, reduce them to a single line of plain text.
+ */
+static gchar *note_to_text(const gchar *note) {
+    static const char *const entities[][2] = {
+        {"&amp;", "&"}, {"&lt;", "<"}, {"&gt;", ">"}, {"&quot;", "\""}, {"&#39;", "'"}, {"&nbsp;", " "}};
+    GString *text = g_string_sized_new(strlen(note));
+    gboolean in_tag = FALSE;
+    for (const char *c = note; *c != '\0'; c++) {
+        if (*c == '<') {
+            in_tag = TRUE;
+        } else if (*c == '>' || (!in_tag && g_ascii_isspace(*c))) {
+            in_tag = in_tag && *c != '>';
+            // Tags and runs of whitespace collapse into a single space.
+            if (text->len > 0 && text->str[text->len - 1] != ' ') {
+                g_string_append_c(text, ' ');
+            }
+        } else if (in_tag) {
+            continue;
+        } else if (*c == '&') {
+            gboolean found = FALSE;
+            for (gsize i = 0; i < G_N_ELEMENTS(entities) && !found; i++) {
+                if (g_str_has_prefix(c, entities[i][0])) {
+                    g_string_append(text, entities[i][1]);
+                    c += strlen(entities[i][0]) - 1;
+                    found = TRUE;
+                }
+            }
+            if (!found) {
+                g_string_append_c(text, *c);
+            }
+        } else {
+            g_string_append_c(text, *c);
+        }
+    }
+    return g_strchomp(g_string_free(text, FALSE));
+}
+
+static sqlite3_stmt *preview_statement(ZoteroModePrivateData *pd, PreviewStatement which, sqlite3_int64 item_id) {
+    static const char **const statements[PREVIEW_NUM_STATEMENTS] = {
+        [PREVIEW_FIELDS] = &PREVIEW_FIELDS_STATEMENT,
+        [PREVIEW_TAGS] = &PREVIEW_TAGS_STATEMENT,
+        [PREVIEW_NOTE] = &PREVIEW_NOTE_STATEMENT,
+    };
+    if (pd->preview_statements[which] == NULL) {
+        if (sqlite3_prepare_v3(pd->db, *statements[which], -1, SQLITE_PREPARE_PERSISTENT,
+                               &pd->preview_statements[which], 0) != SQLITE_OK) {
+            g_debug("Can't prepare preview statement: %s", sqlite3_errmsg(pd->db));
+            return NULL;
+        }
+    }
+    sqlite3_stmt *statement = pd->preview_statements[which];
+    sqlite3_reset(statement);
+    sqlite3_bind_int64(statement, 1, item_id);
+    return statement;
+}
+
+static gchar *render_preview(ZoteroModePrivateData *pd, Entry *e) {
+    static const char *const venues[] = {"publicationTitle", "proceedingsTitle", "conferenceName",
+                                         "bookTitle",        "university",       "publisher"};
+    gchar *abstract = NULL;
+    gchar *venue = NULL;
+    gsize venue_rank = G_N_ELEMENTS(venues);
+    gchar *tags = NULL;
+    gchar *note = NULL;
+
+    sqlite3_stmt *statement = preview_statement(pd, PREVIEW_FIELDS, e->item_id);
+    if (statement != NULL) {
+        while (sqlite3_step(statement) == SQLITE_ROW) {
+            const char *field = (const char *)sqlite3_column_text(statement, 0);
+            const char *value = (const char *)sqlite3_column_text(statement, 1);
+            if (g_strcmp0(field, "abstractNote") == 0) {
+                g_free(abstract);
+                abstract = truncate_text(value, PREVIEW_ABSTRACT_LENGTH);
+                continue;
+            }
+            for (gsize i = 0; i < venue_rank; i++) {
+                if (g_strcmp0(field, venues[i]) == 0) {
+                    g_free(venue);
+                    venue = g_strdup(value);
+                    venue_rank = i;
+                }
+            }
+        }
+    }
+    statement = preview_statement(pd, PREVIEW_TAGS, e->item_id);
+    if (statement != NULL) {
+        if (sqlite3_step(statement) == SQLITE_ROW && sqlite3_column_text(statement, 0) != NULL) {
+            tags = g_strdup((const char *)sqlite3_column_text(statement, 0));
+        }
+    }
+    statement = preview_statement(pd, PREVIEW_NOTE, e->item_id);
+    if (statement != NULL) {
+        if (sqlite3_step(statement) == SQLITE_ROW && sqlite3_column_text(statement, 0) != NULL) {
+            gchar *text = note_to_text((const char *)sqlite3_column_text(statement, 0));
+            note = truncate_text(text, PREVIEW_NOTE_LENGTH);
+            g_free(text);
+        }
+    }
+
+    GString *markup = g_string_new(NULL);
+    gchar *line = g_markup_printf_escaped("<b>%s</b>", e->name);
+    g_string_append(markup, line);
+    g_free(line);
+    if (venue != NULL) {
+        line = g_markup_printf_escaped("\n<i>%s</i>", venue);
+        g_string_append(markup, line);
+        g_free(line);
+    }
+    if (abstract != NULL) {
+        line = g_markup_printf_escaped("\n%s", abstract);
+        g_string_append(markup, line);
+        g_free(line);
+    }
+    if (tags != NULL) {
+        line = g_markup_printf_escaped("\n<b>Tags:</b> %s", tags);
+        g_string_append(markup, line);
+        g_free(line);
+    }
+    if (note != NULL) {
+        line = g_markup_printf_escaped("\n<b>Note:</b> %s", note);
+        g_string_append(markup, line);
+        g_free(line);
+    }
+    g_free(abstract);
+    g_free(venue);
+    g_free(tags);
+    g_free(note);
+    return g_string_free(markup, FALSE);
+}
+
+/**
+ * Returns the preview of an entry, rendering it on a cache miss. Recently shown
+ * previews are kept in a small LRU so that going back and forth is free.
+ */
+static const gchar *get_preview(ZoteroModePrivateData *pd, Entry *e) {
+    GList *link = g_hash_table_lookup(pd->preview_index, e);
+    if (link != NULL) {
+        g_queue_unlink(&pd->previews, link);
+        g_queue_push_head_link(&pd->previews, link);
+        return ((Preview *)link->data)->markup;
+    }
+    if (pd->previews.length >= PREVIEW_CACHE_SIZE) {
+        Preview *oldest = g_queue_pop_tail(&pd->previews);
+        g_hash_table_remove(pd->preview_index, oldest->entry);
+        destroy_preview(oldest);
+    }
+    Preview *preview = g_malloc(sizeof(Preview));
+    preview->entry = e;
+    preview->markup = render_preview(pd, e);
+    g_queue_push_head(&pd->previews, preview);
+    g_hash_table_insert(pd->preview_index, e, pd->previews.head);
+    return preview->markup;
+}
+
+static void exec_statement(sqlite3 *db, const char *sql) {
+    char *error = NULL;
+    if (sqlite3_exec(db, sql, NULL, NULL, &error) != SQLITE_OK) {
+        g_debug("Failed to execute statement: %s", error);
+        sqlite3_free(error);
+    }
+}
+
+static gchar *read_state(sqlite3 *db, const char *key) {
+    gchar *value = NULL;
+    sqlite3_stmt *statement = 0;
+    sqlite3_prepare_v2(db, "SELECT value FROM state WHERE key = ?1", -1, &statement, 0);
+    sqlite3_bind_text(statement, 1, key, -1, SQLITE_STATIC);
+    if (sqlite3_step(statement) == SQLITE_ROW) {
+        value = g_strdup((const char *)sqlite3_column_text(statement, 0));
+    }
+    sqlite3_finalize(statement);
+    return value;
+}
+
+static void write_state(sqlite3 *db, const char *key, const char *value) {
+    sqlite3_stmt *statement = 0;
+    sqlite3_prepare_v2(db, "INSERT OR REPLACE INTO state(key, value) VALUES(?1, ?2)", -1, &statement, 0);
+    sqlite3_bind_text(statement, 1, key, -1, SQLITE_STATIC);
+    sqlite3_bind_text(statement, 2, value, -1, SQLITE_STATIC);
+    sqlite3_step(statement);
+    sqlite3_finalize(statement);
+}
+
+/**
+ * Brings the notes index in the cache dir up to date with the Zotero database.
+ * Only notes and annotations modified since the last run are looked at, an
+ * annotation also when its attachment was modified (moved to another item).
+ * Deleted items are found by their key in Zotero's deleteLog. dateModified
+ * has a resolution of a second, so the last second is indexed again.
+ *
+ * Rows are indexed in order of modification, so when cancel is set the rows
+ * done so far are committed and the next run continues from there. Removing
+ * the index file rebuilds it from scratch.
+ */
+static void update_notes_index(const gchar *url, const gint *cancel) {
+    char *path = g_build_filename(g_get_user_cache_dir(), NOTES_CACHE_FILE, NULL);
+    sqlite3 *db = NULL;
+    if (sqlite3_open_v2(path, &db, SQLITE_OPEN_CREATE | SQLITE_OPEN_READWRITE | SQLITE_OPEN_URI, NULL) != SQLITE_OK) {
+        g_debug("Can't open notes index: %s", sqlite3_errmsg(db));
+        sqlite3_close(db);
+        g_free(path);
+        return;
+    }
+    g_free(path);
+    GTimer *timer = g_timer_new();
+    exec_statement(db, NOTES_SCHEMA);
+
+    // Indexes written before the keys table existed can't see deletions.
+    sqlite3_stmt *statement = 0;
+    sqlite3_prepare_v2(db, "PRAGMA user_version", -1, &statement, 0);
+    int version = sqlite3_step(statement) == SQLITE_ROW ? sqlite3_column_int(statement, 0) : 0;
+    sqlite3_finalize(statement);
+    if (version < 1) {
+        exec_statement(db, "DELETE FROM notes; DELETE FROM state; PRAGMA user_version = 1");
+    }
+
+    sqlite3_stmt *attach = 0;
+    sqlite3_prepare_v2(db, "ATTACH DATABASE ?1 AS zotero", -1, &attach, 0);
+    sqlite3_bind_text(attach, 1, url, -1, SQLITE_STATIC);
+    int rc = sqlite3_step(attach);
+    sqlite3_finalize(attach);
+    if (rc != SQLITE_DONE) {
+        g_debug("Can't attach database: %s", sqlite3_errmsg(db));
+        g_timer_destroy(timer);
+        sqlite3_close(db);
+        return;
+    }
+
+    gchar *last_modified = read_state(db, "modified");
+    gchar *last_deleted = read_state(db, "deleted");
+
+    exec_statement(db, "BEGIN");
+    sqlite3_stmt *remove = 0, *insert = 0, *remember = 0, *forget = 0;
+    sqlite3_prepare_v2(db, "DELETE FROM notes WHERE rowid = ?1", -1, &remove, 0);
+    sqlite3_prepare_v2(db, "INSERT INTO notes(rowid, text, parent, attachment) VALUES(?1, ?2, ?3, ?4)", -1, &insert,
+                       0);
+    sqlite3_prepare_v2(db, "INSERT OR REPLACE INTO keys(key, item, attachment) VALUES(?1, ?2, ?3)", -1, &remember, 0);
+    sqlite3_prepare_v2(db, "DELETE FROM keys WHERE key = ?1", -1, &forget, 0);
+
+    if (sqlite3_prepare_v2(db, NOTES_DELETED_STATEMENT, -1, &statement, 0) != SQLITE_OK) {
+        g_debug("Can't prepare notes statement: %s", sqlite3_errmsg(db));
+    }
+    sqlite3_bind_text(statement, 1, last_deleted != NULL ? last_deleted : "", -1, SQLITE_TRANSIENT);
+    unsigned int deleted = 0;
+    while (sqlite3_step(statement) == SQLITE_ROW) {
+        const char *deleted_at = (const char *)sqlite3_column_text(statement, 2);
+        sqlite3_reset(remove);
+        sqlite3_bind_int64(remove, 1, sqlite3_column_int64(statement, 1));
+        sqlite3_step(remove);
+        sqlite3_reset(forget);
+        sqlite3_bind_value(forget, 1, sqlite3_column_value(statement, 0));
+        sqlite3_step(forget);
+        if (deleted_at != NULL && g_strcmp0(deleted_at, last_deleted) > 0) {
+            g_free(last_deleted);
+            last_deleted = g_strdup(deleted_at);
+        }
+        deleted++;
+    }
+    sqlite3_finalize(statement);
+
+    if (sqlite3_prepare_v2(db, NOTES_CHANGED_STATEMENT, -1, &statement, 0) != SQLITE_OK) {
+        g_debug("Can't prepare notes statement: %s", sqlite3_errmsg(db));
+    }
+    sqlite3_bind_text(statement, 1, last_modified != NULL ? last_modified : "", -1, SQLITE_TRANSIENT);
+    unsigned int n = 0;
+    while (!g_atomic_int_get(cancel) && sqlite3_step(statement) == SQLITE_ROW) {
+        sqlite3_int64 item_id = sqlite3_column_int64(statement, 0);
+        const char *text = (const char *)sqlite3_column_text(statement, 5);
+        const char *modified = (const char *)sqlite3_column_text(statement, 6);
+
+        sqlite3_reset(remove);
+        sqlite3_bind_int64(remove, 1, item_id);
+        sqlite3_step(remove);
+        // Notes that were made standalone and annotations of standalone
+        // attachments aren't searched.
+        if (sqlite3_column_type(statement, 2) != SQLITE_NULL) {
+            gchar *plain = sqlite3_column_int(statement, 7) ? note_to_text(text != NULL ? text : "") : g_strdup(text);
+            sqlite3_reset(insert);
+            sqlite3_bind_int64(insert, 1, item_id);
+            sqlite3_bind_text(insert, 2, plain, -1, SQLITE_TRANSIENT);
+            sqlite3_bind_value(insert, 3, sqlite3_column_value(statement, 2));
+            sqlite3_bind_value(insert, 4, sqlite3_column_value(statement, 3));
+            sqlite3_step(insert);
+            g_free(plain);
+        }
+        sqlite3_reset(remember);
+        sqlite3_bind_value(remember, 1, sqlite3_column_value(statement, 1));
+        sqlite3_bind_int64(remember, 2, item_id);
+        sqlite3_bind_value(remember, 3, sqlite3_column_value(statement, 4));
+        sqlite3_step(remember);
+
+        if (modified != NULL && g_strcmp0(modified, last_modified) > 0) {
+            g_free(last_modified);
+            last_modified = g_strdup(modified);
+        }
+        n++;
+    }
+    sqlite3_finalize(statement);
+    sqlite3_finalize(remove);
+    sqlite3_finalize(insert);
+    sqlite3_finalize(remember);
+    sqlite3_finalize(forget);
+
+    write_state(db, "modified", last_modified);
+    write_state(db, "deleted", last_deleted);
+    exec_statement(db, "COMMIT");
+
+    g_debug("Indexed %u notes and annotations and dropped %u deleted ones in %.3fs%s.", n, deleted,
+            g_timer_elapsed(timer, NULL), g_atomic_int_get(cancel) ? ", cancelled" : "");
+    g_timer_destroy(timer);
+    g_free(last_modified);
+    g_free(last_deleted);
+    sqlite3_close(db);
+}
+
+static gpointer notes_indexer(gpointer data) {
+    ZoteroModePrivateData *pd = (ZoteroModePrivateData *)data;
+    update_notes_index(pd->notes_url, &pd->notes_cancel);
+    g_atomic_int_set(&pd->notes_ready, TRUE);
+    return NULL;
+}
+
+static gchar *notes_query(const char *input) {
+    gchar **words = g_strsplit_set(input, " \t", -1);
+    GString *query = g_string_new(NULL);
+    for (gchar **word = words; *word != NULL; word++) {
+        if (**word == '\0') {
+            continue;
+        }
+        gchar **quotes = g_strsplit(*word, "\"", -1);
+        gchar *escaped = g_strjoinv("\"\"", quotes);
+        g_string_append_printf(query, "%s\"%s\"*", query->len > 0 ? " AND " : "", escaped);
+        g_free(escaped);
+        g_strfreev(quotes);
+    }
+    g_strfreev(words);
+    return g_string_free(query, FALSE);
+}
+
+/**
+ * Finds the items with notes or annotations matching the input. The index is
+ * opened on first use after the indexer is done with it, until then nothing
+ * matches.
+ */
+static GHashTable *search_notes(ZoteroModePrivateData *pd, const char *input) {
+    if (pd->notes_indexer != NULL && g_atomic_int_get(&pd->notes_ready)) {
+        g_thread_join(pd->notes_indexer);
+        pd->notes_indexer = NULL;
+        char *path = g_build_filename(g_get_user_cache_dir(), NOTES_CACHE_FILE, NULL);
+        if (sqlite3_open_v2(path, &pd->notes_db, SQLITE_OPEN_READONLY, NULL) != SQLITE_OK ||
+            sqlite3_prepare_v3(pd->notes_db, NOTES_SEARCH_STATEMENT, -1, SQLITE_PREPARE_PERSISTENT, &pd->notes_search,
+                               0) != SQLITE_OK) {
+            g_debug("Can't open notes index: %s", sqlite3_errmsg(pd->notes_db));
+        }
+        g_free(path);
+    }
+    GHashTable *matches = g_hash_table_new(g_direct_hash, g_direct_equal);
+    gchar *query = notes_query(input);
+    if (pd->notes_search != NULL && *query != '\0') {
+        sqlite3_reset(pd->notes_search);
+        sqlite3_bind_text(pd->notes_search, 1, query, -1, SQLITE_TRANSIENT);
+        while (sqlite3_step(pd->notes_search) == SQLITE_ROW) {
+            gsize parent = sqlite3_column_int64(pd->notes_search, 0);
+            g_hash_table_add(matches, GSIZE_TO_POINTER(parent));
+        }
+        sqlite3_reset(pd->notes_search);
+    }
+    g_free(query);
+    return matches;
+}
+
+static void destroy_query_choice(gpointer data) {
+    QueryChoice *choice = (QueryChoice *)data;
+    g_free(choice->path);
+    g_free(choice);
+}
+
+/**
+ * Casefolds the query, collapses whitespace and cuts it at QUERY_MAX_PREFIX
+ * characters.
+ */
+static gchar *normalize_query(const char *input) {
+    gchar *folded = g_utf8_casefold(input, -1);
+    GString *query = g_string_sized_new(strlen(folded));
+    glong length = 0;
+    for (const gchar *c = folded; *c != '\0' && length < QUERY_MAX_PREFIX; c = g_utf8_next_char(c)) {
+        if (g_ascii_isspace(*c)) {
+            if (query->len == 0 || query->str[query->len - 1] == ' ') {
+                continue;
+            }
+            g_string_append_c(query, ' ');
+        } else {
+            g_string_append_len(query, c, g_utf8_next_char(c) - c);
+        }
+        length++;
+    }
+    g_free(folded);
+    return g_strchomp(g_string_free(query, FALSE));
+}
+
+static void load_queries(ZoteroModePrivateData *pd) {
+    pd->queries = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, destroy_query_choice);
+    char *path = g_build_filename(g_get_user_cache_dir(), QUERY_CACHE_FILE, NULL);
+    gchar *contents = NULL;
+    if (g_file_get_contents(path, &contents, NULL, NULL)) {
+        gchar **lines = g_strsplit(contents, "\n", -1);
+        for (gchar **line = lines; *line != NULL; line++) {
+            // <count> <prefix>\t<used>\t<path>, or without <used>\t from
+            // before it was recorded.
+            gchar *prefix = NULL;
+            guint64 count = g_ascii_strtoull(*line, &prefix, 10);
+            gchar *tab = strchr(prefix, '\t');
+            if (prefix == *line || *prefix != ' ' || tab == NULL || count == 0) {
+                continue;
+            }
+            gchar *file = NULL;
+            guint64 used = g_ascii_strtoull(tab + 1, &file, 10);
+            if (file == tab + 1 || *file != '\t') {
+                used = 0;
+                file = tab;
+            }
+            QueryChoice *choice = g_malloc(sizeof(QueryChoice));
+            choice->path = g_strdup(file + 1);
+            choice->count = MIN(count, G_MAXUINT);
+            choice->used = used;
+            pd->query_sequence = MAX(pd->query_sequence, used);
+            choice->entry = g_hash_table_lookup(pd->paths, choice->path);
+            g_hash_table_replace(pd->queries, g_strndup(prefix + 1, tab - prefix - 1), choice);
+        }
+        g_strfreev(lines);
+        g_free(contents);
+    }
+    g_free(path);
+}
+
+/**
+ * Orders the prefixes of the last recorded query first, so they always survive
+ * the trim, then by count and by recency.
+ */
+static int sort_query_choices(gconstpointer a, gconstpointer b, gpointer data) {
+    const ZoteroModePrivateData *pd = (const ZoteroModePrivateData *)data;
+    const QueryChoice *c1 = g_hash_table_lookup(pd->queries, *((const gchar **)a));
+    const QueryChoice *c2 = g_hash_table_lookup(pd->queries, *((const gchar **)b));
+    int retv = (c2->used == pd->query_sequence) - (c1->used == pd->query_sequence);
+    if (retv == 0) {
+        retv = (c2->count > c1->count) - (c2->count < c1->count);
+    }
+    return retv != 0 ? retv : (c2->used > c1->used) - (c2->used < c1->used);
+}
+
+/**
+ * Records that the entry was opened after typing the input, for all of its
+ * prefixes, and writes out the QUERY_CACHE_SIZE most used prefixes.
+ */
+static void record_query(ZoteroModePrivateData *pd, const char *input, Entry *e) {
+    gchar *query = normalize_query(input);
+    glong length = g_utf8_strlen(query, -1);
+    pd->query_sequence++;
+    for (glong i = QUERY_MIN_PREFIX; i <= length; i++) {
+        gchar *prefix = g_utf8_substring(query, 0, i);
+        QueryChoice *choice = g_hash_table_lookup(pd->queries, prefix);
+        if (choice == NULL) {
+            choice = g_malloc0(sizeof(QueryChoice));
+            g_hash_table_insert(pd->queries, prefix, choice);
+        } else {
+            g_free(prefix);
+        }
+        if (g_strcmp0(choice->path, e->path) == 0) {
+            choice->count++;
+        } else if (choice->count > 1) {
+            choice->count--;
+        } else {
+            g_free(choice->path);
+            choice->path = g_strdup(e->path);
+            choice->count = 1;
+        }
+        choice->used = pd->query_sequence;
+        choice->entry = g_hash_table_lookup(pd->paths, choice->path);
+    }
+    g_free(query);
+
+    guint size = 0;
+    gchar **prefixes = (gchar **)g_hash_table_get_keys_as_array(pd->queries, &size);
+    g_qsort_with_data(prefixes, size, sizeof(gchar *), sort_query_choices, pd);
+    GString *contents = g_string_new(NULL);
+    for (guint i = 0; i < size; i++) {
+        if (i < QUERY_CACHE_SIZE) {
+            QueryChoice *choice = g_hash_table_lookup(pd->queries, prefixes[i]);
+            g_string_append_printf(contents, "%u %s\t%" G_GUINT64_FORMAT "\t%s\n", choice->count, prefixes[i],
+                                   choice->used, choice->path);
+        } else {
+            g_hash_table_remove(pd->queries, prefixes[i]);
+        }
+    }
+    g_free(prefixes);
+    char *path = g_build_filename(g_get_user_cache_dir(), QUERY_CACHE_FILE, NULL);
+    GError *error = NULL;
+    if (!g_file_set_contents(path, contents->str, contents->len, &error)) {
+        g_debug("Failed to write query cache: %s", error->message);
+        g_error_free(error);
+    }
+    g_free(path);
+    g_string_free(contents, TRUE);
+}
+
+typedef struct {
+    GArray *entries;
+    const int *frecency;
+    SortOrder order;
+} OrderContext;
+
+static int compare_newest(sqlite3_int64 a, sqlite3_int64 b) { return (a < b) - (a > b); }
+
+static int sort_order(gconstpointer a, gconstpointer b, gpointer data) {
+    const OrderContext *context = (const OrderContext *)data;
+    unsigned int i1 = *((const unsigned int *)a);
+    unsigned int i2 = *((const unsigned int *)b);
+    const Entry *e1 = &g_array_index(context->entries, Entry, i1);
+    const Entry *e2 = &g_array_index(context->entries, Entry, i2);
+    int retv = 0;
+    switch (context->order) {
+    case ORDER_FRECENCY:
+        retv = context->frecency[i1] - context->frecency[i2];
+        break;
+    case ORDER_DATE_ADDED:
+        retv = compare_newest(e1->date_added, e2->date_added);
+        break;
+    case ORDER_DATE_MODIFIED:
+        retv = compare_newest(e1->date_modified, e2->date_modified);
+        break;
+    case ORDER_YEAR:
+        retv = compare_newest(g_ascii_strtoll(e1->year, NULL, 10), g_ascii_strtoll(e2->year, NULL, 10));
+        break;
+    case ORDER_TITLE:
+        retv = g_ascii_strcasecmp(e1->name != NULL ? e1->name : "", e2->name != NULL ? e2->name : "");
+        break;
+    case ORDER_AUTHOR:
+        retv = g_ascii_strcasecmp(e1->author != NULL ? e1->author : "", e2->author != NULL ? e2->author : "");
+        break;
+    case ORDER_NUM:
+        break;
+    }
+    // Entries are loaded in byte order of the title, which breaks all ties.
+    return retv != 0 ? retv : (i1 > i2) - (i1 < i2);
+}
+
+/**
+ * Builds the permutation of every sort order once, switching orders afterwards
+ * only swaps the active permutation.
+ */
+static void build_orders(ZoteroModePrivateData *pd, const int *frecency) {
+    OrderContext context = {.entries = pd->entries, .frecency = frecency};
+    unsigned int length = pd->entries->len;
+    for (SortOrder order = 0; order < ORDER_NUM; order++) {
+        pd->orders[order] = g_new(unsigned int, length);
+        pd->ranks[order] = g_new(unsigned int, length);
+        for (unsigned int i = 0; i < length; i++) {
+            pd->orders[order][i] = i;
+        }
+        context.order = order;
+        g_qsort_with_data(pd->orders[order], length, sizeof(unsigned int), sort_order, &context);
+        for (unsigned int i = 0; i < length; i++) {
+            pd->ranks[order][pd->orders[order][i]] = i;
+        }
+    }
+}
+
+/**
+ * Maps a row to an entry in the active sort order, with the entry learned for
+ * the current query moved to the top.
+ */
+static Entry *entry_at(const ZoteroModePrivateData *pd, unsigned int index) {
+    const unsigned int *order = pd->orders[pd->order];
+    if (pd->boosted != NULL && index <= pd->ranks[pd->order][pd->boosted->sort_index]) {
+        return index == 0 ? pd->boosted : &g_array_index(pd->entries, Entry, order[index - 1]);
+    }
+    return &g_array_index(pd->entries, Entry, order[index]);
+}
+
+static void format_add_literal(Format *format, const gchar *literal, gsize length) {
+    if (length > 0) {
+        FormatOp op = {.field = FIELD_NONE, .literal = literal, .length = length};
+        g_array_append_val(format->ops, op);
+    }
+}
+
+/**
+ * Compiles a format like "{year} {title|60} - {authors|first,etal}" into a list
+ * of ops. Fields are title, year, authors and path; filters are a maximum
+ * number of characters, first and etal.
+ */
+static Format *format_compile(const char *source, gboolean markup) {
+    Format *format = g_malloc0(sizeof(Format));
+    format->source = g_strdup(source);
+    format->ops = g_array_new(FALSE, TRUE, sizeof(FormatOp));
+    format->markup = markup;
+    const gchar *literal = format->source;
+    const gchar *c = format->source;
+    while (*c != '\0') {
+        const gchar *end = *c == '{' ? strchr(c, '}') : NULL;
+        if (end == NULL) {
+            c++;
+            continue;
+        }
+        gchar *spec = g_strndup(c + 1, end - c - 1);
+        gchar **parts = g_strsplit_set(spec, "|,", -1);
+        FormatOp op = {.field = FIELD_NONE};
+        for (gsize i = FIELD_TITLE; parts[0] != NULL && i < G_N_ELEMENTS(FIELD_NAMES); i++) {
+            if (g_strcmp0(g_strstrip(parts[0]), FIELD_NAMES[i]) == 0) {
+                op.field = i;
+            }
+        }
+        for (gchar **filter = parts + 1; op.field != FIELD_NONE && *filter != NULL; filter++) {
+            g_strstrip(*filter);
+            if ((g_strcmp0(*filter, "first") == 0 || g_strcmp0(*filter, "etal") == 0) && op.field != FIELD_AUTHORS) {
+                g_debug("Filter '%s' only applies to authors in format '%s'.", *filter, source);
+            } else if (g_strcmp0(*filter, "first") == 0) {
+                op.first = TRUE;
+            } else if (g_strcmp0(*filter, "etal") == 0) {
+                op.first = op.etal = TRUE;
+            } else if (g_ascii_isdigit(**filter)) {
+                op.max_chars = g_ascii_strtoll(*filter, NULL, 10);
+            } else {
+                g_debug("Unknown filter '%s' in format '%s'.", *filter, source);
+            }
+        }
+        g_strfreev(parts);
+        g_free(spec);
+        if (op.field == FIELD_NONE) {
+            g_debug("Unknown field '%.*s' in format '%s'.", (int)(end - c + 1), c, source);
+            c = end + 1;
+            continue;
+        }
+        format_add_literal(format, literal, c - literal);
+        g_array_append_val(format->ops, op);
+        literal = c = end + 1;
+    }
+    format_add_literal(format, literal, c - literal);
+    return format;
+}
+
+static void format_free(Format *format) {
+    if (format != NULL) {
+        g_array_free(format->ops, TRUE);
+        g_free(format->source);
+        g_free(format);
+    }
+}
+
+/**
+ * Copies len bytes of str into out, escaping markup when asked. With out NULL
+ * only the length is computed.
+ */
+static gsize format_copy(gchar *out, const gchar *str, gsize len, gboolean escape) {
+    if (!escape) {
+        if (out != NULL) {
+            memcpy(out, str, len);
+        }
+        return len;
+    }
+    gsize written = 0;
+    for (gsize i = 0; i < len; i++) {
+        const char *replacement = NULL;
+        switch (str[i]) {
+        case '&':
+            replacement = "&amp;";
+            break;
+        case '<':
+            replacement = "&lt;";
+            break;
+        case '>':
+            replacement = "&gt;";
+            break;
+        case '"':
+            replacement = "&quot;";
+            break;
+        case '\'':
+            replacement = "&#39;";
+            break;
+        }
+        gsize length = replacement != NULL ? strlen(replacement) : 1;
+        if (out != NULL) {
+            memcpy(out + written, replacement != NULL ? replacement : str + i, length);
+        }
+        written += length;
+    }
+    return written;
+}
+
+/**
+ * Renders an entry with a compiled format into out, which has to be large
+ * enough; call with out NULL first to get the size. Returns the length
+ * without the terminating '\0', which is written as well.
+ */
+static gsize format_render(const Format *format, const Entry *e, gchar *out) {
+    gsize written = 0;
+    for (guint i = 0; i < format->ops->len; i++) {
+        const FormatOp *op = &g_array_index(format->ops, FormatOp, i);
+        gchar *dest = out != NULL ? out + written : NULL;
+        if (op->field == FIELD_NONE) {
+            written += format_copy(dest, op->literal, op->length, FALSE);
+            continue;
+        }
+        const gchar *value = NULL;
+        switch (op->field) {
+        case FIELD_TITLE:
+            value = e->name;
+            break;
+        case FIELD_YEAR:
+            value = e->year;
+            break;
+        case FIELD_AUTHORS:
+            value = e->author;
+            break;
+        case FIELD_PATH:
+            value = e->path;
+            break;
+        case FIELD_NONE:
+            break;
+        }
+        value = value != NULL ? value : "";
+        gsize len = strlen(value);
+        gboolean more = FALSE;
+        if (op->first) {
+            const gchar *separator = strchr(value, ';');
+            if (separator != NULL) {
+                len = separator - value;
+                more = TRUE;
+            }
+        }
+        gboolean truncated = FALSE;
+        if (op->max_chars > 0 && g_utf8_strlen(value, len) > op->max_chars) {
+            len = g_utf8_offset_to_pointer(value, op->max_chars) - value;
+            truncated = TRUE;
+        }
+        written += format_copy(dest, value, len, format->markup);
+        if (truncated) {
+            written += format_copy(out != NULL ? out + written : NULL, "…", strlen("…"), FALSE);
+        }
+        if (op->etal && more) {
+            written += format_copy(out != NULL ? out + written : NULL, " et al.", strlen(" et al."), FALSE);
+        }
+    }
+    if (out != NULL) {
+        out[written] = '\0';
+    }
+    return written;
 }
 
 static void get_zotero(Mode *sw) {
     ZoteroModePrivateData *pd = (ZoteroModePrivateData *)mode_get_private_data(sw);
-    pd->entries = g_ptr_array_new_with_free_func(destroy_element);
+    pd->strings = g_ptr_array_new_with_free_func((GDestroyNotify)g_string_chunk_free);
+    pd->identifiers = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    pd->preview_index = g_hash_table_new(g_direct_hash, g_direct_equal);
+    g_queue_init(&pd->previews);
     pd->zotero_path = g_strconcat(g_get_home_dir(), "/Zotero/", NULL);
     gchar *db_name = g_strconcat(pd->zotero_path, "zotero.sqlite", NULL);
     gchar *url = g_strconcat("file:", db_name, "?mode=ro&immutable=1", NULL);
@@ -104,43 +1520,65 @@ static void get_zotero(Mode *sw) {
         if (rc) {
             g_debug("Can't open database: %s\n", sqlite3_errmsg(pd->db));
             sqlite3_close(pd->db);
+            pd->db = NULL;
         }
     } else {
         g_debug("Database does not exist.");
     }
     g_free(db_name);
-    g_free(url);
 
-    sqlite3_stmt *statement = 0;
-    sqlite3_prepare_v2(pd->db, STATEMENT, -1, &statement, 0);
-    int n = 0;
-    while (sqlite3_step(statement) == SQLITE_ROW) {
-        Entry *e = g_malloc(sizeof(Entry));
-        char *year = (char *)sqlite3_column_text(statement, 3);
-        e->name = g_strdup((gchar *)sqlite3_column_text(statement, 0));
-        e->path = g_strdup((gchar *)sqlite3_column_text(statement, 1));
-        e->author = g_strdup((gchar *)sqlite3_column_text(statement, 2));
-        e->year = year == NULL ? g_strdup("") : g_strdup(year);
-        e->sort_index = n++;
-        g_ptr_array_add(pd->entries, e);
+    load_entries(pd, url);
+    if (pd->db != NULL) {
+        pd->notes_url = url;
+        pd->notes_indexer = g_thread_new("zotero-notes", notes_indexer, pd);
+    } else {
+        g_free(url);
     }
-    sqlite3_finalize(statement);
 
     unsigned int length = 0;
     const char *cache_dir = g_get_user_cache_dir();
     char *path = g_build_filename(cache_dir, DRUN_CACHE_FILE, NULL);
     gchar **retv = history_get_list(path, &length);
+    pd->paths = g_hash_table_new(g_str_hash, g_str_equal);
+    for (unsigned int i = 0; i < pd->entries->len; i++) {
+        Entry *e = &g_array_index(pd->entries, Entry, i);
+        if (e->path != NULL && !g_hash_table_contains(pd->paths, e->path)) {
+            g_hash_table_insert(pd->paths, e->path, e);
+        }
+    }
+    // Entries from the history go first, most used on top.
+    int *frecency = g_new(int, pd->entries->len);
+    for (unsigned int i = 0; i < pd->entries->len; i++) {
+        frecency[i] = i;
+    }
     for (unsigned int index = 0; index < length; index++) {
-        for (unsigned int i = 0; i < pd->entries->len; i++) {
-            Entry *e = g_ptr_array_index(pd->entries, i);
-            if (g_strcmp0(e->path, retv[index]) == 0) {
-                e->sort_index = -(length - index);
-            }
+        Entry *e = g_hash_table_lookup(pd->paths, retv[index]);
+        if (e != NULL) {
+            frecency[e->sort_index] = -(length - index);
         }
     }
-    g_ptr_array_sort(pd->entries, sort_entries);
+    build_orders(pd, frecency);
+    g_free(frecency);
     g_free(path);
     g_strfreev(retv);
+
+    pd->order = ORDER_FRECENCY;
+    char *order = NULL;
+    if (find_arg_str("-zotero-sort", &order)) {
+        for (SortOrder i = 0; i < ORDER_NUM; i++) {
+            if (g_strcmp0(order, ORDER_NAMES[i]) == 0) {
+                pd->order = i;
+            }
+        }
+    }
+    load_queries(pd);
+
+    char *display_format = DEFAULT_DISPLAY_FORMAT;
+    char *match_format = DEFAULT_MATCH_FORMAT;
+    find_arg_str("-zotero-display-format", &display_format);
+    find_arg_str("-zotero-match-format", &match_format);
+    pd->display_format = format_compile(display_format, find_arg("-zotero-display-markup") >= 0);
+    pd->match_format = format_compile(match_format, FALSE);
 }
 
 static int zotero_mode_init(Mode *sw) {
@@ -166,14 +1604,28 @@ static ModeMode zotero_mode_result(Mode *sw, int menu_entry, char **input, unsig
         retv = PREVIOUS_DIALOG;
     } else if (menu_entry & MENU_QUICK_SWITCH) {
         retv = (menu_entry & MENU_LOWER_MASK);
+    } else if (menu_entry & MENU_CUSTOM_COMMAND) {
+        // kb-custom-1 previews the selected entry in the message pane.
+        if ((menu_entry & MENU_LOWER_MASK) == 0 && selected_line < pd->entries->len) {
+            Entry *res = entry_at(pd, selected_line);
+            pd->preview_entry = pd->preview_entry == res ? NULL : res;
+        }
+        // kb-custom-2 cycles through the sort orders.
+        if ((menu_entry & MENU_LOWER_MASK) == 1) {
+            pd->order = (pd->order + 1) % ORDER_NUM;
+        }
+        retv = RELOAD_DIALOG;
     } else if ((menu_entry & MENU_OK)) {
-        Entry *res = g_ptr_array_index(pd->entries, selected_line);
+        Entry *res = entry_at(pd, selected_line);
         char *default_cmd = "xdg-open";
         gchar *cmd = g_strconcat(default_cmd, " \"", pd->zotero_path, res->path, "\"", NULL);
         helper_execute_command(NULL, cmd, FALSE, NULL);
         const char *cache_dir = g_get_user_cache_dir();
         char *path = g_build_filename(cache_dir, DRUN_CACHE_FILE, NULL);
         history_set(path, res->path);
+        if (*input != NULL) {
+            record_query(pd, *input, res);
+        }
         g_free(path);
         g_free(cmd);
     }
@@ -183,7 +1635,32 @@ static ModeMode zotero_mode_result(Mode *sw, int menu_entry, char **input, unsig
 static void zotero_mode_destroy(Mode *sw) {
     ZoteroModePrivateData *pd = (ZoteroModePrivateData *)mode_get_private_data(sw);
     if (pd != NULL) {
-        g_ptr_array_free(pd->entries, TRUE);
+        g_array_free(pd->entries, TRUE);
+        g_ptr_array_free(pd->strings, TRUE);
+        g_hash_table_destroy(pd->identifiers);
+        g_hash_table_destroy(pd->preview_index);
+        g_hash_table_destroy(pd->queries);
+        g_hash_table_destroy(pd->paths);
+        for (int i = 0; i < ORDER_NUM; i++) {
+            g_free(pd->orders[i]);
+            g_free(pd->ranks[i]);
+        }
+        if (pd->notes_indexer != NULL) {
+            g_atomic_int_set(&pd->notes_cancel, TRUE);
+            g_thread_join(pd->notes_indexer);
+        }
+        g_free(pd->notes_url);
+        if (pd->note_matches != NULL) {
+            g_hash_table_destroy(pd->note_matches);
+        }
+        sqlite3_finalize(pd->notes_search);
+        sqlite3_close(pd->notes_db);
+        format_free(pd->display_format);
+        format_free(pd->match_format);
+        g_queue_clear_full(&pd->previews, destroy_preview);
+        for (int i = 0; i < PREVIEW_NUM_STATEMENTS; i++) {
+            sqlite3_finalize(pd->preview_statements[i]);
+        }
         sqlite3_close(pd->db);
         g_free(pd->zotero_path);
         g_free(pd);
@@ -191,28 +1668,70 @@ static void zotero_mode_destroy(Mode *sw) {
     }
 }
 
-static char *zotero_get_display_value(const Mode *sw, unsigned int selected_line, G_GNUC_UNUSED int *state,
+static char *zotero_get_display_value(const Mode *sw, unsigned int selected_line, int *state,
                                       G_GNUC_UNUSED GList **attr_list, int get_entry) {
     ZoteroModePrivateData *pd = (ZoteroModePrivateData *)mode_get_private_data(sw);
-    Entry *res = g_ptr_array_index(pd->entries, selected_line);
-    gsize size = strlen(res->name) + strlen(res->author) + strlen(res->year) + 3 + 3 + 1;
-    gchar *buffer = g_newa(gchar, size);
-    g_snprintf(buffer, size, "[%s] %s - %s", res->year, res->name, res->author);
-    return get_entry ? g_strdup(buffer) : NULL;
+    if (pd->display_format->markup) {
+        *state |= STATE_MARKUP;
+    }
+    if (!get_entry) {
+        return NULL;
+    }
+    Entry *res = entry_at(pd, selected_line);
+    gchar *buffer = g_malloc(format_render(pd->display_format, res, NULL) + 1);
+    format_render(pd->display_format, res, buffer);
+    return buffer;
 }
 
 static int zotero_token_match(const Mode *sw, rofi_int_matcher **tokens, unsigned int index) {
     ZoteroModePrivateData *pd = (ZoteroModePrivateData *)mode_get_private_data(sw);
-    Entry *res = g_ptr_array_index(pd->entries, index);
-    gsize size = strlen(res->name) + strlen(res->author) + strlen(res->year) + 3 + 3 + 1;
-    gchar *buffer = g_newa(gchar, size);
-    g_snprintf(buffer, size, "[%s] %s - %s", res->year, res->name, res->author);
+    Entry *res = entry_at(pd, index);
+    if (pd->identifier_match != NULL) {
+        return res == pd->identifier_match;
+    }
+    if (pd->note_matches != NULL) {
+        return g_hash_table_contains(pd->note_matches, GSIZE_TO_POINTER(res->item_id));
+    }
+    gchar *buffer = g_newa(gchar, format_render(pd->match_format, res, NULL) + 1);
+    format_render(pd->match_format, res, buffer);
     return helper_token_match(tokens, buffer);
 }
 
-static char *zotero_get_message(const Mode *sw) { return g_markup_printf_escaped("Results:"); }
+static char *zotero_get_message(const Mode *sw) {
+    ZoteroModePrivateData *pd = (ZoteroModePrivateData *)mode_get_private_data(sw);
+    if (pd->note_matches != NULL && pd->notes_indexer != NULL) {
+        return g_markup_printf_escaped("Indexing notes and annotations…");
+    }
+    Entry *e = pd->identifier_match != NULL ? pd->identifier_match : pd->preview_entry;
+    e = e != NULL ? e : pd->key_match;
+    if (e == NULL || pd->db == NULL) {
+        if (pd->order != ORDER_FRECENCY) {
+            return g_markup_printf_escaped("Results by %s:", ORDER_NAMES[pd->order]);
+        }
+        return g_markup_printf_escaped("Results:");
+    }
+    return g_strdup(get_preview(pd, e));
+}
 
-static char *zotero_preprocess_input(Mode *sw, const char *input) { return g_markup_printf_escaped("%s", input); }
+static char *zotero_preprocess_input(Mode *sw, const char *input) {
+    ZoteroModePrivateData *pd = (ZoteroModePrivateData *)mode_get_private_data(sw);
+    gboolean exact = FALSE;
+    Entry *match = lookup_identifier(pd, input, &exact);
+    pd->identifier_match = exact ? match : NULL;
+    pd->key_match = exact ? NULL : match;
+    if (pd->note_matches != NULL) {
+        g_hash_table_destroy(pd->note_matches);
+        pd->note_matches = NULL;
+    }
+    if (input != NULL && input[0] == NOTES_SEARCH_PREFIX) {
+        pd->note_matches = search_notes(pd, input + 1);
+    }
+    gchar *query = normalize_query(input);
+    QueryChoice *choice = g_hash_table_lookup(pd->queries, query);
+    pd->boosted = choice == NULL ? NULL : choice->entry;
+    g_free(query);
+    return g_markup_printf_escaped("%s", input);
+}
 
 // static char *zotero_get_completion(const Mode *sw, unsigned int index);
 // static cairo_surface_t *yt_get_icon(const Mode *sw, unsigned int selected_line, unsigned int height);